@@ -1,9 +1,83 @@
 #include "server.h"
 #include <iostream>
 
-Server::Server(QObject *parent) : QObject(parent), m_server(new QTcpServer(this))
+// Replays of /api/orders/create are answered from memory for this long
+static const qint64 IDEMPOTENCY_TTL_SECS = 24 * 60 * 60;
+static const int IDEMPOTENCY_MAX_KEYS = 10000;
+static const int IDEMPOTENCY_KEY_MAX_LENGTH = 255;
+static const int IDEMPOTENCY_PURGE_MS = 60 * 60 * 1000;
+
+// Fingerprint of the fields that define an order; QJsonObject keys are
+// serialized in sorted order, so equal requests hash equally
+static QByteArray orderRequestHash(const QJsonObject &request)
 {
+    QJsonObject order;
+    order["customer_id"] = request["customer_id"];
+    order["products"] = request["products"];
+    return QCryptographicHash::hash(QJsonDocument(order).toJson(QJsonDocument::Compact),
+                                    QCryptographicHash::Sha256).toHex();
+}
+
+// Order stream: events kept for resuming, and unsent bytes a subscriber may
+// accumulate before it is dropped as a slow consumer
+static const int ORDER_EVENT_HISTORY = 1000;
+static const qint64 ORDER_SUBSCRIBER_MAX_PENDING = 64 * 1024;
+static const int ORDER_HEARTBEAT_MS = 15000;
+
+// Admission control: requests admitted and not yet closed, connections
+// still sending their request, connections per client address, how many
+// rate buckets to keep, and how long and large a request may be
+static const int MAX_IN_FLIGHT_REQUESTS = 64;
+static const int MAX_AWAITING_CONNECTIONS = 128;
+static const int MAX_CONNECTIONS_PER_CLIENT = 8;
+static const int MAX_RATE_BUCKETS = 10000;
+static const int REQUEST_TIMEOUT_MS = 10000;
+static const int MAX_REQUEST_BYTES = 1024 * 1024;
+
+struct RateLimit {
+    double burst;
+    double perSecond;
+};
+
+// Every path outside handleRequest shares one "other" bucket, so made-up
+// paths cannot create fresh buckets and push real ones out of the cache
+static QString rateLimitRoute(const QString &endpoint)
+{
+    static const QSet<QString> routes = {
+        "/api/products/add", "/api/products/edit", "/api/products/delete", "/api/products/get",
+        "/api/orders/create", "/api/orders/process", "/api/orders/update", "/api/orders/stream",
+        "/api/metrics/shed",
+        "/api/customers/add", "/api/customers/edit", "/api/customers/delete", "/api/customers/get",
+        "/api/revenue/report",
+        "/api/employees/add", "/api/employees/edit", "/api/employees/delete", "/api/employees/get",
+    };
+    return routes.contains(endpoint) ? endpoint : QStringLiteral("other");
+}
+
+// Report queries scan the whole orders table, so they get the tightest limit
+static RateLimit rateLimitFor(const QString &endpoint)
+{
+    if (endpoint == "/api/revenue/report") {
+        return {2, 0.2};
+    }
+    if (endpoint.endsWith("/get") || endpoint == "/api/orders/stream" || endpoint == "/api/metrics/shed") {
+        return {20, 5};
+    }
+    return {10, 2};
+}
+
+Server::Server(QObject *parent) : QObject(parent), m_server(new QTcpServer(this)),
+    m_idempotencyPurgeTimer(new QTimer(this)),
+    m_orderEventEpoch(QByteArray::number(QDateTime::currentMSecsSinceEpoch())), m_lastOrderEventId(0),
+    m_orderHeartbeatTimer(new QTimer(this)), m_rejectedConnections(0), m_droppedConnections(0)
+{
+    m_rateClock.start();
+    m_rateBuckets.setMaxCost(MAX_RATE_BUCKETS);
     connect(m_server, &QTcpServer::newConnection, this, &Server::incomingConnection);
+    connect(m_orderHeartbeatTimer, &QTimer::timeout, this, &Server::sendOrderHeartbeat);
+    m_orderHeartbeatTimer->start(ORDER_HEARTBEAT_MS);
+    connect(m_idempotencyPurgeTimer, &QTimer::timeout, this, &Server::purgeIdempotencyKeys);
+    m_idempotencyPurgeTimer->start(IDEMPOTENCY_PURGE_MS);
     initDatabase();
 }
 
@@ -33,15 +107,138 @@ void Server::initDatabase()
         qDebug() << "Database connected!";
         qDebug() << "----------------------------------------------";
         std::cout << std::endl;
+        loadIdempotencyKeys();
     }
 }
 
+void Server::loadIdempotencyKeys()
+{
+    // Keys are compared byte for byte, as QHash does, not case-insensitively
+    QSqlQuery createQuery(m_db);
+    if (!createQuery.exec("CREATE TABLE IF NOT EXISTS idempotency_keys ("
+                          "idem_key VARCHAR(255) CHARACTER SET utf8mb4 COLLATE utf8mb4_bin NOT NULL PRIMARY KEY, "
+                          "request_hash CHAR(64) NOT NULL, "
+                          "order_id INT NOT NULL, "
+                          "created_at BIGINT NOT NULL, "
+                          "INDEX (created_at))")) {
+        qDebug() << "Could not create idempotency_keys table:" << createQuery.lastError().text();
+        return;
+    }
+
+    purgeIdempotencyKeys();
+
+    qint64 cutoff = QDateTime::currentSecsSinceEpoch() - IDEMPOTENCY_TTL_SECS;
+
+    // Newest keys last so that the eviction queue stays ordered by expiry
+    QSqlQuery query(m_db);
+    query.prepare("SELECT idem_key, request_hash, order_id, created_at FROM idempotency_keys "
+                  "WHERE created_at > ? ORDER BY created_at DESC LIMIT ?");
+    query.addBindValue(cutoff);
+    query.addBindValue(IDEMPOTENCY_MAX_KEYS);
+    if (!query.exec()) {
+        qDebug() << "Error loading idempotency keys:" << query.lastError().text();
+        return;
+    }
+
+    QList<QString> keys;
+    QList<IdempotencyEntry> entries;
+    while (query.next()) {
+        QJsonObject response;
+        response["status"] = "success";
+        response["order_id"] = query.value(2).toInt();
+        keys.prepend(query.value(0).toString());
+        entries.prepend(IdempotencyEntry{query.value(1).toByteArray(), response,
+                                         query.value(3).toLongLong() + IDEMPOTENCY_TTL_SECS});
+    }
+
+    for (int i = 0; i < keys.size(); ++i) {
+        cacheIdempotencyKey(keys.at(i), entries.at(i).requestHash, entries.at(i).response, entries.at(i).expiresAt);
+    }
+
+    qDebug() << "Idempotency keys loaded:" << m_idempotencyCache.size();
+}
+
+void Server::purgeIdempotencyKeys()
+{
+    qint64 cutoff = QDateTime::currentSecsSinceEpoch() - IDEMPOTENCY_TTL_SECS;
+
+    QSqlQuery deleteQuery(m_db);
+    deleteQuery.prepare("DELETE FROM idempotency_keys WHERE created_at <= ?");
+    deleteQuery.addBindValue(cutoff);
+    if (!deleteQuery.exec()) {
+        qDebug() << "Error purging idempotency keys:" << deleteQuery.lastError().text();
+    }
+
+    pruneIdempotencyKeys();
+}
+
+void Server::pruneIdempotencyKeys()
+{
+    // Every key shares the same TTL, so the queue head always expires first
+    qint64 now = QDateTime::currentSecsSinceEpoch();
+    while (!m_idempotencyOrder.isEmpty()) {
+        auto it = m_idempotencyCache.constFind(m_idempotencyOrder.head());
+        if (it != m_idempotencyCache.constEnd() && it->expiresAt > now
+            && m_idempotencyCache.size() <= IDEMPOTENCY_MAX_KEYS) {
+            break;
+        }
+        m_idempotencyCache.remove(m_idempotencyOrder.dequeue());
+    }
+}
+
+void Server::cacheIdempotencyKey(const QString &key, const QByteArray &requestHash, const QJsonObject &response,
+                                 qint64 expiresAt)
+{
+    m_idempotencyCache.insert(key, IdempotencyEntry{requestHash, response, expiresAt});
+    m_idempotencyOrder.enqueue(key);
+    pruneIdempotencyKeys();
+}
+
 void Server::incomingConnection()
 {
     qDebug() << "New connection received";
     while (m_server->hasPendingConnections()) {
         QTcpSocket *socket = m_server->nextPendingConnection();
-        connect(socket, &QTcpSocket::readyRead, this, [=]() {
+        QString clientAddress = socket->peerAddress().toString();
+        ++m_clientConnections[clientAddress];
+
+        connect(socket, &QTcpSocket::disconnected, this, [this, socket, clientAddress]() {
+            if (--m_clientConnections[clientAddress] <= 0) {
+                m_clientConnections.remove(clientAddress);
+            }
+            m_awaitingRequest.removeOne(socket);
+            m_inFlightRequests.remove(socket);
+            m_pendingRequests.remove(socket);
+            socket->deleteLater();
+        });
+
+        // Connections that do not finish a request in time are dropped, so
+        // idle sockets cannot hold on to the connection caps
+        QTimer::singleShot(REQUEST_TIMEOUT_MS, socket, [this, socket, clientAddress]() {
+            if (!m_orderSubscribers.contains(socket)) {
+                qDebug() << "Dropping idle connection:" << clientAddress;
+                ++m_droppedConnections;
+                socket->abort();
+            }
+        });
+
+        if (m_clientConnections.value(clientAddress) > MAX_CONNECTIONS_PER_CLIENT) {
+            ++m_rejectedConnections;
+            qDebug() << "Too many connections from:" << clientAddress;
+            rejectRequest(socket, "429 Too Many Requests", "Too many open connections", 1);
+            continue;
+        }
+
+        // Make room for the newcomer by dropping whoever has been silent longest
+        m_awaitingRequest.append(socket);
+        if (m_awaitingRequest.size() > MAX_AWAITING_CONNECTIONS) {
+            QTcpSocket *oldest = m_awaitingRequest.takeFirst();
+            qDebug() << "Dropping oldest incomplete connection:" << oldest->peerAddress().toString();
+            ++m_droppedConnections;
+            oldest->abort();
+        }
+
+        connect(socket, &QTcpSocket::readyRead, this, [this, socket]() {
             processRequest(socket);
         });
     }
@@ -49,15 +246,54 @@ void Server::incomingConnection()
 
 void Server::processRequest(QTcpSocket *socket)
 {
-    QByteArray requestData = socket->readAll();
+    // Stream subscribers only ever receive; anything they send is ignored
+    if (m_orderSubscribers.contains(socket)) {
+        socket->readAll();
+        return;
+    }
+
+    // A request may arrive over several reads, so buffer it until the
+    // headers and the Content-Length body are complete
+    QByteArray &pendingData = m_pendingRequests[socket];
+    pendingData.append(socket->readAll());
+
+    if (pendingData.size() > MAX_REQUEST_BYTES) {
+        m_pendingRequests.remove(socket);
+        rejectRequest(socket, "413 Payload Too Large", "Request is too large");
+        return;
+    }
+
+    int emptyLineIndex = pendingData.indexOf("\r\n\r\n");
+    if (emptyLineIndex == -1) {
+        return;
+    }
+
+    // Headers run from the second line up to the first empty line
+    QList<QByteArray> requestLines = pendingData.left(emptyLineIndex).split('\n');
+    QHash<QByteArray, QByteArray> headers;
+    for (int i = 1; i < requestLines.size(); ++i) {
+        QByteArray headerLine = requestLines.at(i).trimmed();
+        int colonIndex = headerLine.indexOf(':');
+        if (colonIndex != -1) {
+            headers.insert(headerLine.left(colonIndex).trimmed().toLower(),
+                           headerLine.mid(colonIndex + 1).trimmed());
+        }
+    }
+
+    if (pendingData.size() - emptyLineIndex - 4 < headers.value("content-length").toInt()) {
+        return;
+    }
+
+    QByteArray requestData = m_pendingRequests.take(socket);
+    m_awaitingRequest.removeOne(socket);
     qDebug() << "Request data received:" << requestData;
 
-    QList<QByteArray> requestLines = requestData.split('\n');
     QString requestLine = requestLines.first();
     QStringList requestParts = requestLine.split(' ');
 
     if (requestParts.size() < 2) {
         qDebug() << "Invalid request format";
+        rejectRequest(socket, "400 Bad Request", "Invalid request format");
         return;
     }
 
@@ -67,20 +303,41 @@ void Server::processRequest(QTcpSocket *socket)
     qDebug() << "HTTP Method:" << method;
     qDebug() << "Endpoint requested:" << endpoint;
 
+    // Browsers ask before sending Idempotency-Key and the other custom
+    // headers; answer without admission or dispatch so no handler runs
+    if (method == "OPTIONS") {
+        sendPreflightResponse(socket);
+        return;
+    }
+
     QByteArray jsonPayload;
     if (method == "POST") {
-        // Find the empty line that separates headers from the body
-        int emptyLineIndex = requestData.indexOf("\r\n\r\n");
-        if (emptyLineIndex != -1) {
-            jsonPayload = requestData.mid(emptyLineIndex + 4);
-        }
+        // The empty line separates headers from the body
+        jsonPayload = requestData.mid(emptyLineIndex + 4);
     }
 
     qDebug() << "JSON payload extracted:" << jsonPayload;
 
+    // Query parameters are only used by the order stream
+    QUrl requestUrl(endpoint);
+    QUrlQuery urlQuery(requestUrl);
+
+    // Reject before parsing the body or touching the database
+    if (!admitRequest(socket->peerAddress().toString(), requestUrl.path(), socket)) {
+        return;
+    }
+
     QJsonDocument reqJson = QJsonDocument::fromJson(jsonPayload);
     QJsonObject reqObj = reqJson.object();
-    reqObj["endpoint"] = endpoint;
+    reqObj["endpoint"] = requestUrl.path();
+    if (headers.contains("idempotency-key")) {
+        reqObj["idempotency_key"] = QString::fromUtf8(headers.value("idempotency-key"));
+    }
+    if (headers.contains("last-event-id")) {
+        reqObj["last_event_id"] = QString::fromUtf8(headers.value("last-event-id"));
+    } else if (urlQuery.hasQueryItem("last_event_id")) {
+        reqObj["last_event_id"] = urlQuery.queryItemValue("last_event_id");
+    }
 
     handleRequest(reqObj, socket);
 }
@@ -105,6 +362,10 @@ void Server::handleRequest(const QJsonObject &request, QTcpSocket *socket)
         processOrder(request, socket);
     } else if (endpoint == "/api/orders/update") {
         updateOrderStatus(request, socket);
+    } else if (endpoint == "/api/orders/stream") {
+        streamOrders(request, socket);
+    } else if (endpoint == "/api/metrics/shed") {
+        getShedMetrics(socket);
     } else if (endpoint == "/api/customers/add") {
         addCustomer(request, socket);
     } else if (endpoint == "/api/customers/edit") {
@@ -123,6 +384,8 @@ void Server::handleRequest(const QJsonObject &request, QTcpSocket *socket)
         deleteEmployee(request, socket);
     } else if (endpoint == "/api/employees/get") {
         getEmployees(socket);
+    } else {
+        rejectRequest(socket, "404 Not Found", "Unknown endpoint");
     }
 }
 
@@ -137,6 +400,147 @@ void Server::sendResponse(QTcpSocket *socket, const QJsonDocument &doc)
     socket->disconnectFromHost();
 }
 
+void Server::sendPreflightResponse(QTcpSocket *socket)
+{
+    QString response = "HTTP/1.1 204 No Content\r\n"
+                       "Access-Control-Allow-Origin: *\r\n"
+                       "Access-Control-Allow-Methods: GET, POST, OPTIONS\r\n"
+                       "Access-Control-Allow-Headers: Content-Type, Idempotency-Key, Last-Event-ID\r\n"
+                       "Access-Control-Max-Age: 86400\r\n\r\n";
+    socket->write(response.toUtf8());
+    socket->flush();
+    socket->disconnectFromHost();
+}
+
+bool Server::admitRequest(const QString &clientAddress, const QString &endpoint, QTcpSocket *socket)
+{
+    QString route = rateLimitRoute(endpoint);
+
+    if (m_inFlightRequests.size() >= MAX_IN_FLIGHT_REQUESTS) {
+        ++m_overloadedRequests[route];
+        qDebug() << "Shedding request, server overloaded:" << clientAddress << endpoint;
+        rejectRequest(socket, "503 Service Unavailable", "Server is busy, please retry", 1);
+        return false;
+    }
+
+    // Buckets are keyed by peer address only; X-API-Key is not authenticated
+    // and would let one client drain a bucket shared with another
+    RateLimit limit = rateLimitFor(route);
+    RateBucket *bucket = refillRateBucket(clientAddress + " " + route, limit.burst, limit.perSecond,
+                                          m_rateClock.elapsed());
+
+    if (bucket->tokens < 1.0) {
+        ++m_rateLimitedRequests[route];
+        qDebug() << "Rate limited:" << clientAddress << endpoint;
+        int retryAfter = qCeil((1.0 - bucket->tokens) / limit.perSecond);
+        rejectRequest(socket, "429 Too Many Requests", "Rate limit exceeded", retryAfter);
+        return false;
+    }
+
+    bucket->tokens -= 1.0;
+    m_inFlightRequests.insert(socket);
+    return true;
+}
+
+Server::RateBucket *Server::refillRateBucket(const QString &bucketKey, double burst, double perSecond, qint64 now)
+{
+    // QCache evicts the least recently used bucket once MAX_RATE_BUCKETS is reached
+    RateBucket *bucket = m_rateBuckets.object(bucketKey);
+    if (!bucket) {
+        bucket = new RateBucket{burst, now};
+        m_rateBuckets.insert(bucketKey, bucket);
+    }
+
+    bucket->tokens = qMin(burst, bucket->tokens + (now - bucket->refilledAt) / 1000.0 * perSecond);
+    bucket->refilledAt = now;
+    return bucket;
+}
+
+void Server::rejectRequest(QTcpSocket *socket, const QByteArray &statusLine, const QString &message, int retryAfter)
+{
+    QJsonObject response;
+    response["status"] = "error";
+    response["message"] = message;
+
+    QByteArray reply = "HTTP/1.1 " + statusLine + "\r\n"
+                       "Access-Control-Allow-Origin: *\r\n";
+    if (retryAfter > 0) {
+        response["retry_after"] = retryAfter;
+        reply.append("Retry-After: " + QByteArray::number(retryAfter) + "\r\n");
+    }
+    reply.append("Content-Type: application/json\r\n\r\n");
+    reply.append(QJsonDocument(response).toJson(QJsonDocument::Compact));
+    socket->write(reply);
+    socket->flush();
+    socket->disconnectFromHost();
+}
+
+void Server::getShedMetrics(QTcpSocket *socket)
+{
+    QJsonObject rateLimited;
+    for (auto it = m_rateLimitedRequests.constBegin(); it != m_rateLimitedRequests.constEnd(); ++it) {
+        rateLimited[it.key()] = double(it.value());
+    }
+
+    QJsonObject overloaded;
+    for (auto it = m_overloadedRequests.constBegin(); it != m_overloadedRequests.constEnd(); ++it) {
+        overloaded[it.key()] = double(it.value());
+    }
+
+    QJsonObject response;
+    response["status"] = "success";
+    response["rate_limited"] = rateLimited;
+    response["overloaded"] = overloaded;
+    response["rejected_connections"] = double(m_rejectedConnections);
+    response["dropped_connections"] = double(m_droppedConnections);
+    response["in_flight_requests"] = m_inFlightRequests.size();
+    response["awaiting_request"] = m_awaitingRequest.size();
+    response["stream_subscribers"] = m_orderSubscribers.size();
+    sendResponse(socket, QJsonDocument(response));
+}
+
+void Server::publishOrderEvent(const QString &type, const QJsonObject &data)
+{
+    OrderEvent event;
+    event.id = ++m_lastOrderEventId;
+    event.frame = "id: " + m_orderEventEpoch + "-" + QByteArray::number(event.id) + "\n"
+                  "event: " + type.toUtf8() + "\n"
+                  "data: " + QJsonDocument(data).toJson(QJsonDocument::Compact) + "\n\n";
+
+    m_orderEvents.enqueue(event);
+    while (m_orderEvents.size() > ORDER_EVENT_HISTORY) {
+        m_orderEvents.dequeue();
+    }
+
+    // Iterate over a copy, slow subscribers are removed while writing
+    const QSet<QTcpSocket *> subscribers = m_orderSubscribers;
+    for (QTcpSocket *subscriber : subscribers) {
+        writeToSubscriber(subscriber, event.frame);
+    }
+}
+
+void Server::writeToSubscriber(QTcpSocket *socket, const QByteArray &frame)
+{
+    // The socket write buffer is the per-subscriber queue; a client that lets
+    // it grow past the limit is dropped and can resume with Last-Event-ID
+    if (socket->bytesToWrite() + frame.size() > ORDER_SUBSCRIBER_MAX_PENDING) {
+        qDebug() << "Dropping slow order stream subscriber:" << socket->peerAddress().toString();
+        m_orderSubscribers.remove(socket);
+        socket->abort();
+        return;
+    }
+
+    socket->write(frame);
+}
+
+void Server::sendOrderHeartbeat()
+{
+    const QSet<QTcpSocket *> subscribers = m_orderSubscribers;
+    for (QTcpSocket *subscriber : subscribers) {
+        writeToSubscriber(subscriber, ": keep-alive\n\n");
+    }
+}
+
 // Product management implementation
 
 void Server::addProduct(const QJsonObject &request, QTcpSocket *socket)
@@ -251,6 +655,83 @@ void Server::addOrder(const QJsonObject &request, QTcpSocket *socket)
 {
     int customerId = request["customer_id"].toInt();
     QJsonArray productsArray = request["products"].toArray();
+    QString idempotencyKey = request["idempotency_key"].toString();
+    qint64 now = QDateTime::currentSecsSinceEpoch();
+
+    if (idempotencyKey.size() > IDEMPOTENCY_KEY_MAX_LENGTH) {
+        QJsonObject response;
+        response["status"] = "error";
+        response["message"] = "Idempotency-Key must be at most 255 characters";
+        sendResponse(socket, QJsonDocument(response));
+        return;
+    }
+
+    // A retried request gets the original reply without touching the database;
+    // a key reused for a different order is refused rather than replayed
+    QByteArray requestHash = orderRequestHash(request);
+    if (!idempotencyKey.isEmpty()) {
+        pruneIdempotencyKeys();
+        auto it = m_idempotencyCache.constFind(idempotencyKey);
+        if (it != m_idempotencyCache.constEnd()) {
+            if (it->requestHash != requestHash) {
+                QJsonObject response;
+                response["status"] = "error";
+                response["message"] = "Idempotency-Key was already used for a different order";
+                sendResponse(socket, QJsonDocument(response));
+                return;
+            }
+            qDebug() << "Replaying order for idempotency key:" << idempotencyKey;
+            sendResponse(socket, QJsonDocument(it->response));
+            return;
+        }
+
+        // Keys evicted from memory are still answered from the database
+        QSqlQuery keyQuery(m_db);
+        keyQuery.prepare("SELECT request_hash, order_id FROM idempotency_keys WHERE idem_key = ? AND created_at > ?");
+        keyQuery.addBindValue(idempotencyKey);
+        keyQuery.addBindValue(now - IDEMPOTENCY_TTL_SECS);
+
+        if (keyQuery.exec() && keyQuery.next()) {
+            QJsonObject response;
+            if (keyQuery.value(0).toByteArray() != requestHash) {
+                response["status"] = "error";
+                response["message"] = "Idempotency-Key was already used for a different order";
+            } else {
+                qDebug() << "Replaying order for stored idempotency key:" << idempotencyKey;
+                response["status"] = "success";
+                response["order_id"] = keyQuery.value(1).toInt();
+            }
+            sendResponse(socket, QJsonDocument(response));
+            return;
+        }
+    }
+
+    // The order, its items and the idempotency key are committed together
+    m_db.transaction();
+
+    // Claim the key before any order work, replacing an expired row not yet
+    // purged; the order id is filled in once the order exists
+    if (!idempotencyKey.isEmpty()) {
+        QSqlQuery expiredQuery(m_db);
+        expiredQuery.prepare("DELETE FROM idempotency_keys WHERE idem_key = ? AND created_at <= ?");
+        expiredQuery.addBindValue(idempotencyKey);
+        expiredQuery.addBindValue(now - IDEMPOTENCY_TTL_SECS);
+
+        QSqlQuery keyQuery(m_db);
+        keyQuery.prepare("INSERT INTO idempotency_keys (idem_key, request_hash, order_id, created_at) VALUES (?, ?, 0, ?)");
+        keyQuery.addBindValue(idempotencyKey);
+        keyQuery.addBindValue(requestHash);
+        keyQuery.addBindValue(now);
+
+        if (!expiredQuery.exec() || !keyQuery.exec()) {
+            m_db.rollback();
+            QJsonObject response;
+            response["status"] = "error";
+            response["message"] = "Could not claim idempotency key";
+            sendResponse(socket, QJsonDocument(response));
+            return;
+        }
+    }
 
     // Insert new order into orders table
     QSqlQuery orderQuery(m_db);
@@ -267,6 +748,7 @@ void Server::addOrder(const QJsonObject &request, QTcpSocket *socket)
     orderQuery.addBindValue(QDate::currentDate());
 
     if (!orderQuery.exec()) {
+        m_db.rollback();
         QJsonObject response;
         response["status"] = "error";
         response["message"] = orderQuery.lastError().text();
@@ -294,6 +776,7 @@ void Server::addOrder(const QJsonObject &request, QTcpSocket *socket)
         orderItemQuery.addBindValue(productTotal);
 
         if (!orderItemQuery.exec()) {
+            m_db.rollback();
             QJsonObject response;
             response["status"] = "error";
             response["message"] = orderItemQuery.lastError().text();
@@ -302,10 +785,48 @@ void Server::addOrder(const QJsonObject &request, QTcpSocket *socket)
         }
     }
 
+    if (!idempotencyKey.isEmpty()) {
+        QSqlQuery keyQuery(m_db);
+        keyQuery.prepare("UPDATE idempotency_keys SET order_id = ? WHERE idem_key = ?");
+        keyQuery.addBindValue(orderId);
+        keyQuery.addBindValue(idempotencyKey);
+
+        if (!keyQuery.exec()) {
+            m_db.rollback();
+            QJsonObject response;
+            response["status"] = "error";
+            response["message"] = keyQuery.lastError().text();
+            sendResponse(socket, QJsonDocument(response));
+            return;
+        }
+    }
+
+    if (!m_db.commit()) {
+        m_db.rollback();
+        QJsonObject response;
+        response["status"] = "error";
+        response["message"] = m_db.lastError().text();
+        sendResponse(socket, QJsonDocument(response));
+        return;
+    }
+
     QJsonObject response;
     response["status"] = "success";
     response["order_id"] = orderId;
+
+    if (!idempotencyKey.isEmpty()) {
+        cacheIdempotencyKey(idempotencyKey, requestHash, response, now + IDEMPOTENCY_TTL_SECS);
+    }
+
     sendResponse(socket, QJsonDocument(response));
+
+    QJsonObject event;
+    event["order_id"] = orderId;
+    event["customer_id"] = customerId;
+    event["total"] = total;
+    event["status"] = "Pending";
+    event["products"] = productsArray;
+    publishOrderEvent("order_created", event);
 }
 
 void Server::processOrder(const QJsonObject &request, QTcpSocket *socket)
@@ -383,6 +904,15 @@ void Server::processOrder(const QJsonObject &request, QTcpSocket *socket)
         }
     }
 
+    // Screens only need to hear about actual changes
+    if (newStatus != currentStatus) {
+        QJsonObject event;
+        event["order_id"] = orderId;
+        event["previous_status"] = currentStatus;
+        event["status"] = newStatus;
+        publishOrderEvent("order_status_changed", event);
+    }
+
     QJsonObject response;
     response["status"] = "success";
     sendResponse(socket, QJsonDocument(response));
@@ -422,11 +952,63 @@ void Server::updateOrderStatus(const QJsonObject &request, QTcpSocket *socket)
         return;
     }
 
+    if (newStatus != currentStatus) {
+        QJsonObject event;
+        event["order_id"] = orderId;
+        event["previous_status"] = currentStatus;
+        event["status"] = newStatus;
+        publishOrderEvent("order_status_changed", event);
+    }
+
     QJsonObject response;
     response["status"] = "success";
     sendResponse(socket, QJsonDocument(response));
 }
 
+void Server::streamOrders(const QJsonObject &request, QTcpSocket *socket)
+{
+    QString header = "HTTP/1.1 200 OK\r\n"
+                     "Access-Control-Allow-Origin: *\r\n"
+                     "Content-Type: text/event-stream\r\n"
+                     "Cache-Control: no-cache\r\n"
+                     "Connection: keep-alive\r\n\r\n";
+    socket->write(header.toUtf8());
+
+    // Ids are "<epoch>-<sequence>". Replay whatever the client missed, or tell
+    // it to reload if the id belongs to an earlier run of the server or the
+    // gap is no longer covered by the retained history
+    if (request.contains("last_event_id")) {
+        QStringList idParts = request["last_event_id"].toString().split('-');
+        bool ok = idParts.size() == 2 && idParts.at(0).toUtf8() == m_orderEventEpoch;
+        quint64 lastEventId = ok ? idParts.at(1).toULongLong(&ok) : 0;
+        quint64 oldestEventId = m_orderEvents.isEmpty() ? m_lastOrderEventId + 1 : m_orderEvents.head().id;
+
+        if (!ok || lastEventId > m_lastOrderEventId || lastEventId + 1 < oldestEventId) {
+            QByteArray currentId = m_orderEventEpoch + "-" + QByteArray::number(m_lastOrderEventId);
+            QJsonObject reset;
+            reset["last_event_id"] = QString::fromUtf8(currentId);
+            socket->write("id: " + currentId + "\n"
+                          "event: reset\n"
+                          "data: " + QJsonDocument(reset).toJson(QJsonDocument::Compact) + "\n\n");
+        } else {
+            for (const OrderEvent &event : m_orderEvents) {
+                if (event.id > lastEventId) {
+                    socket->write(event.frame);
+                }
+            }
+        }
+    }
+
+    // Subscribers stay open indefinitely and must not count as in flight
+    m_inFlightRequests.remove(socket);
+    m_orderSubscribers.insert(socket);
+    connect(socket, &QTcpSocket::disconnected, this, [this, socket]() {
+        m_orderSubscribers.remove(socket);
+    });
+
+    qDebug() << "Order stream subscribers:" << m_orderSubscribers.size();
+}
+
 
 // Customer management implementation
 void Server::addCustomer(const QJsonObject &request, QTcpSocket *socket)
@@ -9,6 +9,12 @@
 #include <QSqlDatabase>
 #include <QSqlQuery>
 #include <QSqlError>
+#include <QHash>
+#include <QQueue>
+#include <QSet>
+#include <QTimer>
+#include <QElapsedTimer>
+#include <QCache>
 
 class Server : public QObject
 {
@@ -33,6 +39,12 @@ private slots:
     void addOrder(const QJsonObject &request, QTcpSocket *socket);
     void processOrder(const QJsonObject &request, QTcpSocket *socket);
     void updateOrderStatus(const QJsonObject &request, QTcpSocket *socket);
+    void streamOrders(const QJsonObject &request, QTcpSocket *socket);
+    void sendOrderHeartbeat();
+    void purgeIdempotencyKeys();
+
+    // Admission control
+    void getShedMetrics(QTcpSocket *socket);
 
     // Customer management
     void addCustomer(const QJsonObject &request, QTcpSocket *socket);
@@ -50,11 +62,67 @@ private slots:
     void getEmployees(QTcpSocket *socket);
 
 private:
+    // Cached reply for a previously seen Idempotency-Key and a hash of the
+    // order it was used for, so a reused key cannot replay a different order
+    struct IdempotencyEntry {
+        QByteArray requestHash;
+        QJsonObject response;
+        qint64 expiresAt;
+    };
+
+    // Server-Sent Event frame kept around so subscribers can resume
+    struct OrderEvent {
+        quint64 id;
+        QByteArray frame;
+    };
+
+    // Token bucket for one client on one route
+    struct RateBucket {
+        double tokens;
+        qint64 refilledAt;
+    };
+
     QTcpServer *m_server;
     QSqlDatabase m_db;
 
+    // Idempotency keys for order creation, oldest first in m_idempotencyOrder
+    QHash<QString, IdempotencyEntry> m_idempotencyCache;
+    QQueue<QString> m_idempotencyOrder;
+    QTimer *m_idempotencyPurgeTimer;
+
+    // Order event stream subscribers and the most recent events, oldest first
+    QSet<QTcpSocket *> m_orderSubscribers;
+    QQueue<OrderEvent> m_orderEvents;
+    QByteArray m_orderEventEpoch;
+    quint64 m_lastOrderEventId;
+    QTimer *m_orderHeartbeatTimer;
+
+    // Rate limiting keyed by "address route", partially received requests,
+    // connections still sending a request (oldest first), admitted requests
+    // not yet closed, connections per address and the shed request counters
+    QCache<QString, RateBucket> m_rateBuckets;
+    QElapsedTimer m_rateClock;
+    QHash<QTcpSocket *, QByteArray> m_pendingRequests;
+    QList<QTcpSocket *> m_awaitingRequest;
+    QSet<QTcpSocket *> m_inFlightRequests;
+    QHash<QString, int> m_clientConnections;
+    QHash<QString, quint64> m_rateLimitedRequests;
+    QHash<QString, quint64> m_overloadedRequests;
+    quint64 m_rejectedConnections;
+    quint64 m_droppedConnections;
+
     void initDatabase();
+    void loadIdempotencyKeys();
+    void pruneIdempotencyKeys();
+    void cacheIdempotencyKey(const QString &key, const QByteArray &requestHash, const QJsonObject &response,
+                             qint64 expiresAt);
     void sendResponse(QTcpSocket *socket, const QJsonDocument &doc);
+    void sendPreflightResponse(QTcpSocket *socket);
+    void publishOrderEvent(const QString &type, const QJsonObject &data);
+    void writeToSubscriber(QTcpSocket *socket, const QByteArray &frame);
+    bool admitRequest(const QString &clientAddress, const QString &endpoint, QTcpSocket *socket);
+    RateBucket *refillRateBucket(const QString &bucketKey, double burst, double perSecond, qint64 now);
+    void rejectRequest(QTcpSocket *socket, const QByteArray &statusLine, const QString &message, int retryAfter = 0);
 };
 
 #endif // SERVER_H